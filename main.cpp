@@ -7,8 +7,19 @@
 		<http://www.brandon-holland.com/irkeyboardemu.html>
  */
 #include <iostream>
+#include <string>
 #include <time.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/sysctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <mach/mach_time.h>
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <ApplicationServices/ApplicationServices.h>
@@ -87,15 +98,69 @@ static io_iterator_t addedIter = 0;
 // Globals for evaluating the key presses
 static UInt8 lastKeyCode = 0;
 static bool lastPressIsLong = false;
-static CFAbsoluteTime lastTime = 0;
 // Depending on the delay between pressing and releasing a key, the daemon will
 // do different operations. `keyRecognitionDelay' is the minimum time between
 // pressing a key and deciding on the action.
 const double keyRecogitionDelay = 0.25; 
 
+// A single timer handles all deadlines: key recognition and metrics
+// connection timeouts. While no deadline is pending it is parked far in the
+// future, so the idle daemon never wakes up on its own.
+static CFRunLoopTimerRef deadlineTimer = 0;
+static bool keyDeadlinePending = false;
+static CFAbsoluteTime keyDeadline = 0;
+const CFTimeInterval timerParkInterval = 1.0e10;
+
+// Cause of the current run loop wakeup, or -1 if not known yet.
+static bool wokenUp = false;
+static int wakeCause = -1;
+
+// Set while `-idle-check' runs; SIGINT and SIGTERM then end the check early.
+static bool idleCheckRunning = false;
+static bool idleCheckInterrupted = false;
+
 // Started with the Plex option?
 bool usePlex = false;
 
+// Signals are forwarded through this pipe to be handled on the run loop.
+static int signalPipe[2] = {-1, -1};
+
+// Tracing globals. All instrumented functions run on the main run loop, so the
+// event buffer belongs to that thread and is written without any locking. It
+// is allocated once when tracing is enabled and used as a ring buffer.
+#define TRACE_BUFFER_EVENTS 65536
+static bool traceEnabled = false;
+static const char *tracePath = 0;
+static int traceFd = -1;
+static struct TraceEvent *traceBuffer = 0;
+static UInt32 traceCount = 0;
+static uint64_t traceOrigin = 0;
+static mach_timebase_info_data_t traceTimebase;
+static unsigned traceThread = 0;
+
+// Statistics globals. Every thread increments its own cache line sized slot of
+// counters; readers sum up all slots without taking any locks.
+#define STATS_MAX_THREADS 8
+#define STATS_MAX_DEVICES 8
+#define STATS_MAX_ERRNO 128
+#define STATS_MAX_CGERRORS 16
+// 128 bytes covers the cache lines of both x86_64 (64) and arm64 (128) Macs.
+#define CACHE_LINE_SIZE 128
+static struct StatsCounters *statsSlots = 0;
+static int statsThreads = 0;
+static pthread_key_t statsKey;
+static struct StatsDevice *statsDevices = 0;
+static int statsDeviceCount = 0;
+
+// Open metrics connections. Connections that don't send a request within
+// `metricsConnectionTimeout' are closed by a timer which is only armed while
+// there are open connections.
+#define METRICS_MAX_CONNECTIONS 4
+const CFTimeInterval metricsConnectionTimeout = 5.0;
+static CFSocketRef metricsConnections[METRICS_MAX_CONNECTIONS];
+static CFAbsoluteTime metricsDeadlines[METRICS_MAX_CONNECTIONS];
+static int metricsHeaderMatched[METRICS_MAX_CONNECTIONS];
+
 
 #pragma mark Declarations (Structures)
 
@@ -106,6 +171,7 @@ typedef struct HIDData
     IOHIDQueueInterface **hidQueueInterface;
     CFDictionaryRef hidElementDictionary;
     CFRunLoopSourceRef eventSource;
+    int deviceIndex;
     UInt8  buffer[256];
 } HIDData;
 
@@ -122,6 +188,47 @@ typedef struct HIDElement {
 
 typedef HIDElement *HIDElementRef;
 
+typedef enum {
+	WakeReport = 0,
+	WakeDeadline,
+	WakeSignal,
+	WakeDevice,
+	WakeMetrics,
+	WakeOther,
+	TOTAL_WAKE_CAUSES
+} WakeCause;
+
+typedef struct TraceEvent {
+	const char *name;
+	const char *argName;
+	uint64_t start;
+	uint64_t duration;
+	SInt32 argValue;
+	char phase;
+} TraceEvent;
+
+// Only contains UInt64 counters, so slots can be summed up word by word.
+typedef struct StatsCounters {
+	UInt64 reports;
+	UInt64 taps[TOTAL_KEY_CODES + 1];
+	UInt64 holds[TOTAL_KEY_CODES + 1];
+	UInt64 timersArmed;
+	UInt64 timersFired;
+	UInt64 sendIRCalls;
+	UInt64 sendIRErrors[STATS_MAX_ERRNO];
+	UInt64 sendIRErrorsOther;
+	UInt64 keyboardEvents;
+	UInt64 keyboardErrors[STATS_MAX_CGERRORS];
+	UInt64 keyboardErrorsOther;
+	UInt64 deviceReports[STATS_MAX_DEVICES];
+	UInt64 wakeups[TOTAL_WAKE_CAUSES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) StatsCounters;
+
+typedef struct StatsDevice {
+	UInt32 locationID;
+	bool attached;
+} StatsDevice;
+
 #pragma mark Declarations (Functions)
 int Initialize();
 void HIDDeviceAdded(void*, io_iterator_t);
@@ -130,9 +237,92 @@ bool FindHIDElements(HIDDataRef);
 void InterruptReportCallbackFunction(void*, IOReturn, void*, void*, uint32_t);
 
 void RemoteKeyPressedCallback(CFRunLoopTimerRef timer, void *info);
+void ArmKeyTimer();
+void DeadlineTimerCallback(CFRunLoopTimerRef timer, void *info);
+void ScheduleDeadlineTimer();
 void HandleKey(UInt8 code);
 void HandleKeyPress(UInt8 code);
 void HandleKeyRelease(UInt8 code);
+void PostKeyboardEvent(CGKeyCode key, bool keyDown);
+
+int InitializeSignals();
+void SignalPipeCallback(CFFileDescriptorRef, CFOptionFlags, void*);
+
+bool TraceStart(const char *path);
+void TraceRecord(char phase, const char *name, uint64_t start, uint64_t end,
+				 const char *argName, SInt32 argValue);
+void TraceWrite();
+
+int InitializeStats();
+StatsCounters *StatsClaimSlot();
+void StatsCollect(StatsCounters *total);
+int StatsAddDevice(io_object_t device);
+int InitializeMetrics(int port);
+void MetricsAcceptCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, const void*, void*);
+void MetricsClientCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, const void*, void*);
+void MetricsCloseConnection(int index);
+CFAbsoluteTime MetricsNextDeadline(CFAbsoluteTime next);
+int MetricsReadRequest(int index, int fd);
+void MetricsExpireConnections(CFAbsoluteTime now);
+
+void InitializeRunLoop();
+void WakeObserverCallback(CFRunLoopObserverRef, CFRunLoopActivity, void*);
+int RunIdleCheck(double seconds);
+
+/*
+ * Records a complete event spanning the lifetime of the object. When tracing
+ * is disabled, this costs a single branch on construction and destruction.
+ */
+struct TraceScope {
+	const char *name;
+	const char *argName;
+	SInt32 argValue;
+	uint64_t start;
+	
+	TraceScope(const char *name, const char *argName = 0, SInt32 argValue = 0)
+	: name(name), argName(argName), argValue(argValue),
+	  start(traceEnabled ? mach_absolute_time() : 0) {}
+	
+	~TraceScope() {
+		if (traceEnabled)
+			TraceRecord('X', name, start, mach_absolute_time(), argName, argValue);
+	}
+};
+
+/*
+ * Records an instant event.
+ */
+inline void TraceInstant(const char *name, const char *argName = 0,
+						 SInt32 argValue = 0) {
+	if (traceEnabled) {
+		uint64_t now = mach_absolute_time();
+		TraceRecord('i', name, now, now, argName, argValue);
+	}
+}
+
+/*
+ * Returns the statistics slot of the calling thread.
+ */
+inline StatsCounters *StatsLocal() {
+	StatsCounters *slot = (StatsCounters *)pthread_getspecific(statsKey);
+	return slot ? slot : StatsClaimSlot();
+}
+
+/*
+ * Maps key codes the daemon does not know about to slot 0.
+ */
+inline UInt8 StatsKeyIndex(UInt8 code) {
+	return code > TOTAL_KEY_CODES ? 0 : code;
+}
+
+/*
+ * Attributes the current run loop wakeup to `cause', unless an earlier
+ * handler already did.
+ */
+inline void NoteWakeCause(WakeCause cause) {
+	if (wokenUp && wakeCause < 0)
+		wakeCause = cause;
+}
 
 
 
@@ -144,16 +334,44 @@ void HandleKeyRelease(UInt8 code);
 int main (const int argc, const char *argv[]) {
 	printf("AsusRemote %s\n%s\n\n", VERSION_STRING, AUTHOR_STRING);
     
-    if (argc > 1) {
-        if (strcmp(argv[1], "-plex") == 0) {
+	if (InitializeStats() != 0) {
+		printf("ERROR: Unable to allocate the statistics counters!\n");
+		return 1;
+	}
+	InitializeRunLoop();
+	
+	double idleCheckSeconds = 0;
+	
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-plex") == 0) {
             printf("* Emulating key presses for Plex *\n");
             usePlex = true;
         }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+            if (TraceStart(argv[++i]))
+                printf("* Tracing input events to %s *\n", tracePath);
+        }
+        else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc) {
+            int port = atoi(argv[++i]);
+            if (InitializeMetrics(port) == 0)
+                printf("* Serving metrics on 127.0.0.1:%d *\n", port);
+            else
+                printf("ERROR: Unable to serve metrics on port %d!\n", port);
+        }
+        else if (strcmp(argv[i], "-idle-check") == 0 && i + 1 < argc) {
+            idleCheckSeconds = atof(argv[++i]);
+        }
     }
 	
+	// Handle signals on the run loop.
+	InitializeSignals();
+	
     // Initialize HID.
 	Initialize();
 	
+	if (idleCheckSeconds > 0)
+		return RunIdleCheck(idleCheckSeconds);
+	
 	// Main loop.
 	CFRunLoopRun();
 }
@@ -170,10 +388,18 @@ void InterruptReportCallbackFunction(void *target, IOReturn result,
 									 uint32_t bufferSize)
 {
     HIDDataRef hidDataRef = (HIDDataRef)refcon;
+    TraceScope span("InterruptReportCallbackFunction", "key");
+    
+    NoteWakeCause(WakeReport);
     
     if (!hidDataRef)
         return;
 	
+	StatsCounters *stats = StatsLocal();
+	stats->reports++;
+	if (hidDataRef->deviceIndex >= 0)
+		stats->deviceReports[hidDataRef->deviceIndex]++;
+	
 	/*
 	 // Dump raw HID data
 	 for (int index = 0; index < bufferSize; index++) {
@@ -184,16 +410,13 @@ void InterruptReportCallbackFunction(void *target, IOReturn result,
 	
 	
 	UInt8 remote_key_code = hidDataRef->buffer[1];
+	span.argValue = remote_key_code;
 	
 	// Call release function if code is 0x00.
 	if (remote_key_code == 0x00) {
-		CFGregorianUnits diff = CFAbsoluteTimeGetDifferenceAsGregorianUnits(
-											CFAbsoluteTimeGetCurrent(), lastTime,
-											0, kCFGregorianUnitsSeconds);
-		double delta = diff.seconds;
-		//printf("delta is %f s\n", delta);
-		
-		if (delta < 0.9*keyRecogitionDelay) {
+		// Released before the deadline: the timer will handle it as a tap.
+		if (keyDeadlinePending) {
+			TraceInstant("classify: tap", "key", lastKeyCode);
 			lastPressIsLong = false;
 		} else {
 			HandleKeyRelease(lastKeyCode);
@@ -202,25 +425,47 @@ void InterruptReportCallbackFunction(void *target, IOReturn result,
 		return;
 	}
 	
+	// Settle a press still waiting for its deadline before the timer is
+	// re-armed, as it would be lost otherwise. A repeated report of the key
+	// being held keeps the running deadline. Any other press means the
+	// earlier one ended before its deadline, which makes it a tap.
+	if (keyDeadlinePending) {
+		if (lastPressIsLong && remote_key_code == lastKeyCode)
+			return;
+		TraceInstant("classify: tap", "key", lastKeyCode);
+		HandleKey(lastKeyCode);
+	}
+	
 	lastKeyCode = remote_key_code;
 	lastPressIsLong = true;
-	lastTime = CFAbsoluteTimeGetCurrent();
 	
-	// Create timer to find out if it was a short key press or a longer action.
-	CFRunLoopTimerRef timer = CFRunLoopTimerCreate(0,
-												   CFAbsoluteTimeGetCurrent()+keyRecogitionDelay,
-												   0, 0, 0, RemoteKeyPressedCallback,
-												   0);
-	CFRunLoopAddTimer(CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
-	CFRelease(timer);
+	// Arm timer to find out if it was a short key press or a longer action.
+	ArmKeyTimer();
+	stats->timersArmed++;
+	TraceInstant("timer arm", "key", remote_key_code);
 }
 
 /*
- * Function to be called when the timer is fired.
+ * Sets the key recognition deadline for the current press.
+ */
+void ArmKeyTimer() {
+	keyDeadline = CFAbsoluteTimeGetCurrent() + keyRecogitionDelay;
+	keyDeadlinePending = true;
+	ScheduleDeadlineTimer();
+}
+
+/*
+ * Function to be called when the key recognition deadline has passed.
  */
 void RemoteKeyPressedCallback(CFRunLoopTimerRef timer, void *info) {
+	TraceScope span("RemoteKeyPressedCallback", "key", lastKeyCode);
+	NoteWakeCause(WakeDeadline);
+	StatsLocal()->timersFired++;
+	keyDeadlinePending = false;
+	
 	if (lastPressIsLong) {
 		// Key is pressed even after the timer was called.
+		TraceInstant("classify: hold", "key", lastKeyCode);
 		HandleKeyPress(lastKeyCode);
 	}
 	else {
@@ -249,9 +494,38 @@ const char* GetKeyName(UInt8 code) {
  * Issue an Apple Remote command using IRKeyboardEmu's sysctl.
  */
 void IssueAppleRemoteCommand(IRKeyboardKey key) {
+	TraceScope span("IssueAppleRemoteCommand", "command", key);
+	StatsCounters *stats = StatsLocal();
+	stats->sendIRCalls++;
+	
 	int ret = sysctlbyname("kern.sendIR", NULL, NULL, &key, sizeof(key));
 	if (ret == -1) {
-		printf("ERROR: Unable issuing sysctl command, errno = %i!\n", errno);
+		int error = errno;
+		if (error > 0 && error < STATS_MAX_ERRNO)
+			stats->sendIRErrors[error]++;
+		else
+			stats->sendIRErrorsOther++;
+		TraceInstant("sendIR error", "errno", error);
+		printf("ERROR: Unable issuing sysctl command, errno = %i!\n", error);
+	}
+}
+
+/*
+ * Post a keyboard event (used for Plex).
+ */
+void PostKeyboardEvent(CGKeyCode key, bool keyDown) {
+	TraceScope span("CGPostKeyboardEvent", "keycode", key);
+	StatsCounters *stats = StatsLocal();
+	stats->keyboardEvents++;
+	
+	CGError error = CGPostKeyboardEvent(0, key, keyDown);
+	if (error != kCGErrorSuccess) {
+		// CGError codes start at kCGErrorFailure.
+		int index = error - kCGErrorFailure;
+		if (index >= 0 && index < STATS_MAX_CGERRORS)
+			stats->keyboardErrors[index]++;
+		else
+			stats->keyboardErrorsOther++;
 	}
 }
 
@@ -259,33 +533,35 @@ void IssueAppleRemoteCommand(IRKeyboardKey key) {
  * Handle short key presses.
  */
 void HandleKey(UInt8 code) {
+	TraceScope span("HandleKey", "key", code);
+	StatsLocal()->taps[StatsKeyIndex(code)]++;
 	printf("Key:          %s\n", GetKeyName(code));
 	
     if (usePlex) {
         switch (code) {
             case KEY_CODE_PLUS:
-                CGPostKeyboardEvent(0, (CGKeyCode)126, true);
-                CGPostKeyboardEvent(0, (CGKeyCode)126, false);
+                PostKeyboardEvent(126, true);
+                PostKeyboardEvent(126, false);
                 break;
             case KEY_CODE_MINUS:
-                CGPostKeyboardEvent(0, (CGKeyCode)125, true);
-                CGPostKeyboardEvent(0, (CGKeyCode)125, false);
+                PostKeyboardEvent(125, true);
+                PostKeyboardEvent(125, false);
                 break;
             case KEY_CODE_REV:
-                CGPostKeyboardEvent(0, (CGKeyCode)123, true);
-                CGPostKeyboardEvent(0, (CGKeyCode)123, false);
+                PostKeyboardEvent(123, true);
+                PostKeyboardEvent(123, false);
                 break;
             case KEY_CODE_FWD:
-                CGPostKeyboardEvent(0, (CGKeyCode)124, true);
-                CGPostKeyboardEvent(0, (CGKeyCode)124, false);
+                PostKeyboardEvent(124, true);
+                PostKeyboardEvent(124, false);
                 break;
             case KEY_CODE_PLAY_PAUSE:
-                CGPostKeyboardEvent(0, (CGKeyCode)36, true);
-                CGPostKeyboardEvent(0, (CGKeyCode)36, false);
+                PostKeyboardEvent(36, true);
+                PostKeyboardEvent(36, false);
                 break;
             case KEY_CODE_MAXIMIZE:
-                CGPostKeyboardEvent(0, (CGKeyCode)53, true);
-                CGPostKeyboardEvent(0, (CGKeyCode)53, false);
+                PostKeyboardEvent(53, true);
+                PostKeyboardEvent(53, false);
                 break;
             case KEY_CODE_AP_LAUNCH:
                 break;
@@ -323,27 +599,29 @@ void HandleKey(UInt8 code) {
  * Handle initial key press on longer key presses.
  */
 void HandleKeyPress(UInt8 code) {
+	TraceScope span("HandleKeyPress", "key", code);
+	StatsLocal()->holds[StatsKeyIndex(code)]++;
 	printf("Key pressed:  %s\n", GetKeyName(code));
     
     if (usePlex) {
         switch (code) {
             case KEY_CODE_PLUS:
-                CGPostKeyboardEvent(0, (CGKeyCode)126, true);
+                PostKeyboardEvent(126, true);
                 break;
             case KEY_CODE_MINUS:
-                CGPostKeyboardEvent(0, (CGKeyCode)125, true);
+                PostKeyboardEvent(125, true);
                 break;
             case KEY_CODE_REV:
-                CGPostKeyboardEvent(0, (CGKeyCode)123, true);
+                PostKeyboardEvent(123, true);
                 break;
             case KEY_CODE_FWD:
-                CGPostKeyboardEvent(0, (CGKeyCode)124, true);
+                PostKeyboardEvent(124, true);
                 break;
             case KEY_CODE_PLAY_PAUSE:
-                CGPostKeyboardEvent(0, (CGKeyCode)36, true);
+                PostKeyboardEvent(36, true);
                 break;
             case KEY_CODE_MAXIMIZE:
-                CGPostKeyboardEvent(0, (CGKeyCode)53, true);
+                PostKeyboardEvent(53, true);
                 break;
             case KEY_CODE_AP_LAUNCH:
                 break;
@@ -381,27 +659,28 @@ void HandleKeyPress(UInt8 code) {
  * Handle final key release on longer key presses.
  */
 void HandleKeyRelease(UInt8 code) {
+	TraceScope span("HandleKeyRelease", "key", code);
 	printf("Key released: %s\n", GetKeyName(code));
     
     if (usePlex) {
         switch (code) {
             case KEY_CODE_PLUS:
-                CGPostKeyboardEvent(0, (CGKeyCode)126, false);
+                PostKeyboardEvent(126, false);
                 break;
             case KEY_CODE_MINUS:
-                CGPostKeyboardEvent(0, (CGKeyCode)125, false);
+                PostKeyboardEvent(125, false);
                 break;
             case KEY_CODE_REV:
-                CGPostKeyboardEvent(0, (CGKeyCode)123, false);
+                PostKeyboardEvent(123, false);
                 break;
             case KEY_CODE_FWD:
-                CGPostKeyboardEvent(0, (CGKeyCode)124, false);
+                PostKeyboardEvent(124, false);
                 break;
             case KEY_CODE_PLAY_PAUSE:
-                CGPostKeyboardEvent(0, (CGKeyCode)36, false);
+                PostKeyboardEvent(36, false);
                 break;
             case KEY_CODE_MAXIMIZE:
-                CGPostKeyboardEvent(0, (CGKeyCode)53, false);
+                PostKeyboardEvent(53, false);
                 break;
             case KEY_CODE_AP_LAUNCH:
                 break;
@@ -437,6 +716,691 @@ void HandleKeyRelease(UInt8 code) {
 
 
 
+#pragma mark Signals
+
+/*
+ * Forwards the signal number to the run loop. Only async-signal-safe calls
+ * are allowed here.
+ */
+void SignalHandler(int sig) {
+	int savedErrno = errno;
+	UInt8 number = (UInt8)sig;
+	write(signalPipe[1], &number, sizeof(number));
+	errno = savedErrno;
+}
+
+/*
+ * Sets up the signal pipe and adds its read end to the run loop.
+ */
+int InitializeSignals() {
+	if (pipe(signalPipe) == -1)
+		return 201;
+	
+	fcntl(signalPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(signalPipe[1], F_SETFL, O_NONBLOCK);
+	
+	CFFileDescriptorRef fdRef = CFFileDescriptorCreate(kCFAllocatorDefault,
+													   signalPipe[0], false,
+													   SignalPipeCallback, 0);
+	if (!fdRef)
+		return 202;
+	
+	CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+	CFRunLoopSourceRef source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, fdRef, 0);
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+	CFRelease(source);
+	
+	struct sigaction action;
+	bzero(&action, sizeof(action));
+	action.sa_handler = SignalHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	
+	sigaction(SIGINT, &action, 0);
+	sigaction(SIGTERM, &action, 0);
+	sigaction(SIGUSR1, &action, 0);
+	
+	return 0;
+}
+
+/*
+ * Handles signals forwarded by `SignalHandler' on the run loop.
+ * SIGUSR1 writes the trace; SIGINT and SIGTERM quit.
+ */
+void SignalPipeCallback(CFFileDescriptorRef fdRef, CFOptionFlags callBackTypes,
+						void *info) {
+	UInt8 sig;
+	
+	NoteWakeCause(WakeSignal);
+	
+	while (read(signalPipe[0], &sig, sizeof(sig)) == sizeof(sig)) {
+		switch (sig) {
+			case SIGUSR1:
+				TraceWrite();
+				break;
+			case SIGINT:
+			case SIGTERM:
+				// Let the idle check report what it has counted so far.
+				if (idleCheckRunning) {
+					idleCheckInterrupted = true;
+					CFRunLoopStop(CFRunLoopGetCurrent());
+					break;
+				}
+				// Pending trace events are written by the exit handler.
+				exit(0);
+			default:
+				break;
+		}
+	}
+	
+	// Callbacks are one-shot and need to be re-enabled.
+	CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+}
+
+
+
+#pragma mark Tracing
+
+/*
+ * Creates the trace file, allocates the trace buffer and enables tracing.
+ * The trace is written to `path' on SIGUSR1 and on exit.
+ */
+bool TraceStart(const char *path) {
+	traceBuffer = (TraceEvent *)calloc(TRACE_BUFFER_EVENTS, sizeof(TraceEvent));
+	if (!traceBuffer) {
+		printf("ERROR: Unable to allocate the trace buffer!\n");
+		return false;
+	}
+	
+	// The daemon may be installed setuid root, so the trace file is created
+	// with the privileges of the invoking user and must not exist yet.
+	uid_t euid = geteuid();
+	gid_t egid = getegid();
+	int error = EPERM;
+	if (setegid(getgid()) == 0 && seteuid(getuid()) == 0) {
+		traceFd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+		error = errno;
+	}
+	seteuid(euid);
+	setegid(egid);
+	
+	if (traceFd == -1) {
+		printf("ERROR: Unable to create trace file %s, errno = %i!\n", path, error);
+		free(traceBuffer);
+		traceBuffer = 0;
+		return false;
+	}
+	
+	mach_timebase_info(&traceTimebase);
+	traceOrigin = mach_absolute_time();
+	traceThread = pthread_mach_thread_np(pthread_self());
+	tracePath = path;
+	traceEnabled = true;
+	atexit(TraceWrite);
+	
+	return true;
+}
+
+/*
+ * Stores an event in the trace buffer, overwriting the oldest one if full.
+ * `name' and `argName' need to be string literals.
+ */
+void TraceRecord(char phase, const char *name, uint64_t start, uint64_t end,
+				 const char *argName, SInt32 argValue) {
+	TraceEvent *event = &traceBuffer[traceCount % TRACE_BUFFER_EVENTS];
+	event->name = name;
+	event->argName = argName;
+	event->start = start;
+	event->duration = end - start;
+	event->argValue = argValue;
+	event->phase = phase;
+	traceCount++;
+}
+
+/*
+ * Converts mach absolute time units to microseconds.
+ */
+static double TraceMicroseconds(uint64_t ticks) {
+	return (double)ticks * traceTimebase.numer / traceTimebase.denom / 1000.0;
+}
+
+/*
+ * Writes the recorded events as Chrome trace event JSON, which can be loaded
+ * into chrome://tracing or Perfetto.
+ */
+void TraceWrite() {
+	if (!traceEnabled)
+		return;
+	
+	// Rewrite the file opened by `TraceStart'; the path is never reopened.
+	FILE *file = 0;
+	if (ftruncate(traceFd, 0) == 0 && lseek(traceFd, 0, SEEK_SET) == 0) {
+		int fd = dup(traceFd);
+		if (fd != -1 && !(file = fdopen(fd, "w")))
+			close(fd);
+	}
+	if (!file) {
+		printf("ERROR: Unable to write trace file %s, errno = %i!\n", tracePath, errno);
+		return;
+	}
+	
+	UInt32 count = traceCount;
+	UInt32 first = 0;
+	if (count > TRACE_BUFFER_EVENTS) {
+		first = count - TRACE_BUFFER_EVENTS;
+		count = TRACE_BUFFER_EVENTS;
+	}
+	
+	int pid = getpid();
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+			"\"args\":{\"name\":\"run loop\"}}", pid, traceThread);
+	
+	for (UInt32 i = 0; i < count; i++) {
+		TraceEvent *event = &traceBuffer[(first + i) % TRACE_BUFFER_EVENTS];
+		
+		fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"input\",\"ph\":\"%c\","
+				"\"ts\":%.3f,\"pid\":%d,\"tid\":%u",
+				event->name, event->phase,
+				TraceMicroseconds(event->start - traceOrigin), pid, traceThread);
+		
+		if (event->phase == 'X')
+			fprintf(file, ",\"dur\":%.3f", TraceMicroseconds(event->duration));
+		else
+			fprintf(file, ",\"s\":\"t\"");
+		
+		if (event->argName)
+			fprintf(file, ",\"args\":{\"%s\":%d}", event->argName, (int)event->argValue);
+		
+		fprintf(file, "}");
+	}
+	
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(file);
+	
+	printf("Wrote %u trace events to %s\n", (unsigned)count, tracePath);
+}
+
+
+
+#pragma mark Statistics
+
+/*
+ * Allocates the per-thread counter slots. Needs to be called before any
+ * other thread is started.
+ */
+int InitializeStats() {
+	if (pthread_key_create(&statsKey, 0) != 0)
+		return 401;
+	
+	// Slots need to be aligned so that no two threads share a cache line.
+	void *slots = 0;
+	if (posix_memalign(&slots, CACHE_LINE_SIZE, STATS_MAX_THREADS * sizeof(StatsCounters)) != 0)
+		return 402;
+	bzero(slots, STATS_MAX_THREADS * sizeof(StatsCounters));
+	statsSlots = (StatsCounters *)slots;
+	
+	statsDevices = (StatsDevice *)calloc(STATS_MAX_DEVICES, sizeof(StatsDevice));
+	if (!statsDevices)
+		return 403;
+	
+	return 0;
+}
+
+/*
+ * Assigns a counter slot to the calling thread. Threads beyond
+ * `STATS_MAX_THREADS' share the last slot and may lose increments.
+ */
+StatsCounters *StatsClaimSlot() {
+	int index = __sync_fetch_and_add(&statsThreads, 1);
+	if (index >= STATS_MAX_THREADS)
+		index = STATS_MAX_THREADS - 1;
+	
+	StatsCounters *slot = &statsSlots[index];
+	pthread_setspecific(statsKey, slot);
+	return slot;
+}
+
+/*
+ * Sums up the counters of all threads into `total'.
+ */
+void StatsCollect(StatsCounters *total) {
+	int threads = statsThreads < STATS_MAX_THREADS ? statsThreads : STATS_MAX_THREADS;
+	const size_t words = sizeof(StatsCounters) / sizeof(UInt64);
+	UInt64 *sum = (UInt64 *)total;
+	
+	bzero(total, sizeof(StatsCounters));
+	for (int i = 0; i < threads; i++) {
+		const volatile UInt64 *slot = (const volatile UInt64 *)&statsSlots[i];
+		for (size_t j = 0; j < words; j++)
+			sum[j] += slot[j];
+	}
+}
+
+/*
+ * Marks the device as attached and returns its index for the per-device
+ * counters, or -1 if there is no free entry. Reconnected devices are
+ * recognized by their location ID and keep their index.
+ */
+int StatsAddDevice(io_object_t device) {
+	UInt32 locationID = 0;
+	CFTypeRef property = IORegistryEntryCreateCFProperty(device, CFSTR(kIOHIDLocationIDKey),
+														 kCFAllocatorDefault, 0);
+	if (property) {
+		if (CFGetTypeID(property) == CFNumberGetTypeID())
+			CFNumberGetValue((CFNumberRef)property, kCFNumberSInt32Type, &locationID);
+		CFRelease(property);
+	}
+	
+	int index;
+	for (index = 0; index < statsDeviceCount; index++) {
+		if (statsDevices[index].locationID == locationID)
+			break;
+	}
+	
+	if (index == statsDeviceCount) {
+		if (statsDeviceCount == STATS_MAX_DEVICES)
+			return -1;
+		statsDeviceCount++;
+	}
+	
+	statsDevices[index].locationID = locationID;
+	statsDevices[index].attached = true;
+	return index;
+}
+
+
+
+#pragma mark Metrics
+
+/*
+ * Starts listening for metrics scrapes on the loopback interface.
+ */
+int InitializeMetrics(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return 301;
+	
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	
+	struct sockaddr_in address;
+	bzero(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+		listen(fd, 4) == -1) {
+		close(fd);
+		return 302;
+	}
+	
+	CFSocketRef socket = CFSocketCreateWithNative(kCFAllocatorDefault, fd,
+												  kCFSocketAcceptCallBack,
+												  MetricsAcceptCallback, 0);
+	if (!socket) {
+		close(fd);
+		return 303;
+	}
+	
+	CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(kCFAllocatorDefault, socket, 0);
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+	CFRelease(source);
+	
+	return 0;
+}
+
+/*
+ * Waits for the request on a newly accepted connection.
+ */
+void MetricsAcceptCallback(CFSocketRef listener, CFSocketCallBackType type,
+						   CFDataRef address, const void *data, void *info) {
+	CFSocketNativeHandle fd = *(const CFSocketNativeHandle *)data;
+	
+	NoteWakeCause(WakeMetrics);
+	
+	int index;
+	for (index = 0; index < METRICS_MAX_CONNECTIONS; index++) {
+		if (!metricsConnections[index])
+			break;
+	}
+	
+	// Refuse connections beyond the limit.
+	if (index == METRICS_MAX_CONNECTIONS) {
+		close(fd);
+		return;
+	}
+	
+	// Don't get killed if the scraper hangs up early, and don't block the
+	// run loop for long if it stops reading.
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+	struct timeval sendTimeout = {1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+	
+	CFSocketRef socket = CFSocketCreateWithNative(kCFAllocatorDefault, fd,
+												  kCFSocketReadCallBack,
+												  MetricsClientCallback, 0);
+	if (!socket) {
+		close(fd);
+		return;
+	}
+	
+	CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(kCFAllocatorDefault, socket, 0);
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+	CFRelease(source);
+	
+	metricsConnections[index] = socket;
+	metricsHeaderMatched[index] = 0;
+	metricsDeadlines[index] = CFAbsoluteTimeGetCurrent() + metricsConnectionTimeout;
+	ScheduleDeadlineTimer();
+}
+
+/*
+ * Closes the connection in slot `index' and updates the deadline timer.
+ */
+void MetricsCloseConnection(int index) {
+	// Also closes the native socket.
+	CFSocketInvalidate(metricsConnections[index]);
+	CFRelease(metricsConnections[index]);
+	metricsConnections[index] = 0;
+	ScheduleDeadlineTimer();
+}
+
+/*
+ * Returns the earliest connection deadline, or `next' if that is earlier.
+ */
+CFAbsoluteTime MetricsNextDeadline(CFAbsoluteTime next) {
+	for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+		if (metricsConnections[i] && metricsDeadlines[i] < next)
+			next = metricsDeadlines[i];
+	}
+	return next;
+}
+
+/*
+ * Closes connections which didn't send a request before `now'.
+ */
+void MetricsExpireConnections(CFAbsoluteTime now) {
+	for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+		if (metricsConnections[i] && metricsDeadlines[i] <= now) {
+			NoteWakeCause(WakeMetrics);
+			MetricsCloseConnection(i);
+		}
+	}
+}
+
+/*
+ * Sends all of `size' bytes, returning false if the connection failed.
+ */
+static bool MetricsSend(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t sent = send(fd, data, size, 0);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+/*
+ * Appends printf-style formatted text to `out'.
+ */
+static void MetricsAppend(std::string &out, const char *format, ...) {
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	out += line;
+}
+
+/*
+ * Reads what has arrived of the request on connection `index'. Returns 1 once
+ * the end of the request header has been read, 0 if more data is needed and
+ * -1 if the connection was closed or failed. The request itself is ignored.
+ */
+int MetricsReadRequest(int index, int fd) {
+	static const char headerEnd[] = "\r\n\r\n";
+	char request[1024];
+	
+	ssize_t received = recv(fd, request, sizeof(request), 0);
+	if (received <= 0)
+		return -1;
+	
+	int matched = metricsHeaderMatched[index];
+	for (ssize_t i = 0; i < received && matched < 4; i++) {
+		if (request[i] == headerEnd[matched])
+			matched++;
+		else
+			matched = request[i] == headerEnd[0] ? 1 : 0;
+	}
+	metricsHeaderMatched[index] = matched;
+	
+	return matched == 4 ? 1 : 0;
+}
+
+/*
+ * Answers any request with the current counters in Prometheus text format
+ * and closes the connection. Clients that don't finish their request are
+ * closed by the connection deadline.
+ */
+void MetricsClientCallback(CFSocketRef socket, CFSocketCallBackType type,
+						   CFDataRef address, const void *data, void *info) {
+	CFSocketNativeHandle fd = CFSocketGetNative(socket);
+	
+	NoteWakeCause(WakeMetrics);
+	
+	int index;
+	for (index = 0; index < METRICS_MAX_CONNECTIONS; index++) {
+		if (metricsConnections[index] == socket)
+			break;
+	}
+	if (index == METRICS_MAX_CONNECTIONS)
+		return;
+	
+	int status = MetricsReadRequest(index, fd);
+	if (status == 0)
+		return;
+	
+	if (status > 0) {
+		StatsCounters stats;
+		StatsCollect(&stats);
+		
+		std::string body;
+		body += "# HELP asusremote_reports_total HID reports received.\n"
+				"# TYPE asusremote_reports_total counter\n";
+		MetricsAppend(body, "asusremote_reports_total %llu\n", stats.reports);
+		
+		body += "# HELP asusremote_key_presses_total Classified key presses.\n"
+				"# TYPE asusremote_key_presses_total counter\n";
+		for (int code = 0; code <= TOTAL_KEY_CODES; code++) {
+			const char *name = code ? GetKeyName(code) : "Unknown";
+			MetricsAppend(body, "asusremote_key_presses_total{key=\"%s\",kind=\"tap\"} %llu\n",
+						  name, stats.taps[code]);
+			MetricsAppend(body, "asusremote_key_presses_total{key=\"%s\",kind=\"hold\"} %llu\n",
+						  name, stats.holds[code]);
+		}
+		
+		body += "# HELP asusremote_timers_total Key recognition timers.\n"
+				"# TYPE asusremote_timers_total counter\n";
+		MetricsAppend(body, "asusremote_timers_total{state=\"armed\"} %llu\n", stats.timersArmed);
+		MetricsAppend(body, "asusremote_timers_total{state=\"fired\"} %llu\n", stats.timersFired);
+		
+		body += "# HELP asusremote_output_calls_total Commands sent to the output.\n"
+				"# TYPE asusremote_output_calls_total counter\n";
+		MetricsAppend(body, "asusremote_output_calls_total{output=\"sendIR\"} %llu\n", stats.sendIRCalls);
+		MetricsAppend(body, "asusremote_output_calls_total{output=\"keyboard\"} %llu\n", stats.keyboardEvents);
+		
+		body += "# HELP asusremote_output_errors_total Failed output calls by errno.\n"
+				"# TYPE asusremote_output_errors_total counter\n";
+		for (int error = 1; error < STATS_MAX_ERRNO; error++) {
+			if (stats.sendIRErrors[error])
+				MetricsAppend(body, "asusremote_output_errors_total{output=\"sendIR\",errno=\"%d\"} %llu\n",
+							  error, stats.sendIRErrors[error]);
+		}
+		MetricsAppend(body, "asusremote_output_errors_total{output=\"sendIR\",errno=\"other\"} %llu\n",
+					  stats.sendIRErrorsOther);
+		
+		body += "# HELP asusremote_keyboard_errors_total Failed keyboard events by CGError.\n"
+				"# TYPE asusremote_keyboard_errors_total counter\n";
+		for (int index = 0; index < STATS_MAX_CGERRORS; index++) {
+			if (stats.keyboardErrors[index])
+				MetricsAppend(body, "asusremote_keyboard_errors_total{error=\"%d\"} %llu\n",
+							  kCGErrorFailure + index, stats.keyboardErrors[index]);
+		}
+		MetricsAppend(body, "asusremote_keyboard_errors_total{error=\"other\"} %llu\n",
+					  stats.keyboardErrorsOther);
+		
+		int attached = 0;
+		body += "# HELP asusremote_device_reports_total HID reports received per device.\n"
+				"# TYPE asusremote_device_reports_total counter\n";
+		for (int i = 0; i < statsDeviceCount; i++) {
+			MetricsAppend(body, "asusremote_device_reports_total{location=\"0x%08x\"} %llu\n",
+						  (unsigned)statsDevices[i].locationID, stats.deviceReports[i]);
+			attached += statsDevices[i].attached;
+		}
+		
+		body += "# HELP asusremote_devices_attached Receivers currently attached.\n"
+				"# TYPE asusremote_devices_attached gauge\n";
+		MetricsAppend(body, "asusremote_devices_attached %d\n", attached);
+		
+		static const char *wakeCauseNames[TOTAL_WAKE_CAUSES] =
+		{"report", "deadline", "signal", "device", "metrics", "other"};
+		body += "# HELP asusremote_wakeups_total Run loop wakeups by cause.\n"
+				"# TYPE asusremote_wakeups_total counter\n";
+		for (int cause = 0; cause < TOTAL_WAKE_CAUSES; cause++)
+			MetricsAppend(body, "asusremote_wakeups_total{cause=\"%s\"} %llu\n",
+						  wakeCauseNames[cause], stats.wakeups[cause]);
+		
+		std::string response;
+		MetricsAppend(response, "HTTP/1.0 200 OK\r\n"
+					  "Content-Type: text/plain; version=0.0.4\r\n"
+					  "Content-Length: %lu\r\n"
+					  "Connection: close\r\n\r\n", (unsigned long)body.size());
+		response += body;
+		
+		if (!MetricsSend(fd, response.data(), response.size()))
+			printf("ERROR: Unable to send metrics, errno = %i!\n", errno);
+	}
+	
+	MetricsCloseConnection(index);
+}
+
+
+
+#pragma mark Idle
+
+/*
+ * Creates the deadline timer and starts accounting for wakeups.
+ */
+void InitializeRunLoop() {
+	CFAbsoluteTime parked = CFAbsoluteTimeGetCurrent() + timerParkInterval;
+	deadlineTimer = CFRunLoopTimerCreate(0, parked, timerParkInterval, 0, 0,
+										 DeadlineTimerCallback, 0);
+	CFRunLoopAddTimer(CFRunLoopGetCurrent(), deadlineTimer, kCFRunLoopDefaultMode);
+	
+	CFRunLoopObserverRef observer = CFRunLoopObserverCreate(0,
+															kCFRunLoopAfterWaiting | kCFRunLoopBeforeWaiting | kCFRunLoopExit,
+															true, 0, WakeObserverCallback, 0);
+	CFRunLoopAddObserver(CFRunLoopGetCurrent(), observer, kCFRunLoopDefaultMode);
+	CFRelease(observer);
+}
+
+/*
+ * Arms the deadline timer for the earliest pending deadline, or parks it if
+ * there is none.
+ */
+void ScheduleDeadlineTimer() {
+	CFAbsoluteTime next = CFAbsoluteTimeGetCurrent() + timerParkInterval;
+	if (keyDeadlinePending && keyDeadline < next)
+		next = keyDeadline;
+	
+	CFRunLoopTimerSetNextFireDate(deadlineTimer, MetricsNextDeadline(next));
+}
+
+/*
+ * Handles all deadlines which have passed and re-arms the timer.
+ */
+void DeadlineTimerCallback(CFRunLoopTimerRef timer, void *info) {
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	
+	if (keyDeadlinePending && keyDeadline <= now)
+		RemoteKeyPressedCallback(timer, info);
+	MetricsExpireConnections(now);
+	
+	ScheduleDeadlineTimer();
+}
+
+/*
+ * Counts every run loop wakeup once its handlers have run. Handlers report
+ * the cause through `NoteWakeCause'.
+ */
+void WakeObserverCallback(CFRunLoopObserverRef observer,
+						  CFRunLoopActivity activity, void *info) {
+	if (activity == kCFRunLoopAfterWaiting) {
+		wokenUp = true;
+		wakeCause = -1;
+		return;
+	}
+	
+	if (!wokenUp)
+		return;
+	wokenUp = false;
+	
+	// Leaving the run loop without any handler having run means it timed
+	// out, which is not a wakeup of the daemon itself.
+	if (activity == kCFRunLoopExit && wakeCause < 0)
+		return;
+	
+	int cause = wakeCause < 0 ? WakeOther : wakeCause;
+	StatsLocal()->wakeups[cause]++;
+	TraceInstant("wakeup", "cause", cause);
+}
+
+/*
+ * Runs the daemon for `seconds' and reports the wakeups in that period.
+ * Keys should not be pressed meanwhile. Returns 0 if the daemon stayed idle
+ * for the whole period.
+ */
+int RunIdleCheck(double seconds) {
+	printf("Checking for idle wakeups for %g s...\n", seconds);
+	
+	StatsCounters before, after;
+	StatsCollect(&before);
+	CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+	idleCheckRunning = true;
+	CFRunLoopRunInMode(kCFRunLoopDefaultMode, seconds, false);
+	idleCheckRunning = false;
+	double elapsed = CFAbsoluteTimeGetCurrent() - start;
+	StatsCollect(&after);
+	
+	if (idleCheckInterrupted)
+		printf("Idle check interrupted after %.3f s!\n", elapsed);
+	
+	UInt64 total = 0;
+	UInt64 wakeups[TOTAL_WAKE_CAUSES];
+	for (int cause = 0; cause < TOTAL_WAKE_CAUSES; cause++) {
+		wakeups[cause] = after.wakeups[cause] - before.wakeups[cause];
+		total += wakeups[cause];
+	}
+	
+	printf("Wakeups: %llu (%.3f/s); report %llu, deadline %llu, signal %llu, "
+		   "device %llu, metrics %llu, other %llu\n",
+		   total, elapsed > 0 ? total / elapsed : 0.0, wakeups[WakeReport],
+		   wakeups[WakeDeadline], wakeups[WakeSignal], wakeups[WakeDevice],
+		   wakeups[WakeMetrics], wakeups[WakeOther]);
+	
+	return total == 0 && !keyDeadlinePending && !idleCheckInterrupted ? 0 : 1;
+}
+
+
+
 #pragma mark HID
 
 /*
@@ -496,6 +1460,8 @@ void HIDDeviceAdded(void *refCon, io_iterator_t iterator) {
 	SInt32 score;
 	bool pass;
 	
+	NoteWakeCause(WakeDevice);
+	
 	// Iterate through all matching devices.
 	while (hidDevice = IOIteratorNext(iterator)) {
 		kr = IOCreatePlugInInterfaceForService(hidDevice, kIOHIDDeviceUserClientTypeID, 
@@ -512,6 +1478,7 @@ void HIDDeviceAdded(void *refCon, io_iterator_t iterator) {
 			hidDataRef = (HIDDataRef)malloc(sizeof(HIDData));
 			bzero(hidDataRef, sizeof(HIDData));
 			hidDataRef->hidDeviceInterface = hidDeviceInterface;
+			hidDataRef->deviceIndex = StatsAddDevice(hidDevice);
 			
 			/* Open the device. */
             result = (*(hidDataRef->hidDeviceInterface))->open (hidDataRef->hidDeviceInterface, 0);
@@ -559,6 +1526,8 @@ void DeviceNotification(void *			refCon,
     kern_return_t	kr;
     HIDDataRef		hidDataRef = (HIDDataRef) refCon;
 	
+    NoteWakeCause(WakeDevice);
+    
     /* Check to see if a device went away and clean up. */
     if ( (hidDataRef != NULL) &&
 		(messageType == kIOMessageServiceIsTerminated) )
@@ -583,6 +1552,9 @@ void DeviceNotification(void *			refCon,
             kr = IOObjectRelease(hidDataRef->notification);
             hidDataRef->notification = 0;
         }
+        
+        if (hidDataRef->deviceIndex >= 0)
+            statsDevices[hidDataRef->deviceIndex].attached = false;
 		
     }
 }